@@ -4,60 +4,319 @@
 #include <stdint.h>
 #include <time.h>
 #include <string.h>
-#include "sha1.h" 
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "sha1.h"
 
-#define PEERS 100 //总100个peer
+#ifndef PEERS
+#define PEERS 100 //总100个peer，可用 -DPEERS=N 放大网络规模
+#endif
 #define BUCKETS 160 //总160个桶
 #define BUCKET_SIZE 3
+#define K_VALUE 2 //FindNode 返回的最近节点数，也是每个Key的副本数
+#define SHORTLIST_SIZE (BUCKET_SIZE * 8) //迭代查找时候选列表的上限
+#define CACHE_LINE 64
+#define BLOOM_BITS_PER_KEY 10 //Key摘要按存储容量每个Key 10位，存储扩容时按新容量重建
+#define BLOOM_MIN_BITS 64
+#define BLOOM_HASHES 7
+#define KEY_TAIL_MIN 64 //有序索引尾段超过这个长度且超过总数的平方根时并入主段
+#define ORACLE_THREADS 64
+#define ORACLE_MIN_PER_THREAD 65536 //每个线程至少扫描这么多ID，节点少时不开线程
+#define BUCKET_CHUNK 16 //桶按16个一组分配，分配后地址不变，读者无需加锁
+#define BENCH_HOT_PEERS 4 //并发基准中所有线程只访问这几个节点的路由表，制造竞争
+#define RTT_UNIT_US 100 //桶中RTT估计的单位（0.1ms）
+#define RPC_TIMEOUT_US 500000 //发往离线节点的RPC等待这么久后超时
+#define PNS_MARGIN 4 //新联系人的RTT不超过最慢联系人的(PNS_MARGIN-1)/PNS_MARGIN时才替换它
+#define PROXIMITY_LOOKUPS 1000 //比较选路方式时每种方式的查找次数
+#define PROXIMITY_MAX_HOPS 32 //按跳数统计延迟时，超过这个跳数的查找合并计入
 
-typedef struct Node {
-    uint8_t id[BUCKET_SIZE];
-    struct Node* next;
-} Node;
+// 节点句柄：全局PeerID表中的下标，路由表和候选列表只保存句柄
+typedef uint32_t PeerHandle;
+#define NO_PEER UINT32_MAX
 
-typedef struct Bucket { 
-    Node* bucket[BUCKET_SIZE];
+// 桶中只保存32位的摘要句柄（摘要表中的下标）而不是指针，0表示没有摘要
+typedef uint32_t SummaryHandle;
+#define NO_SUMMARY 0
+
+// 节点已存储Key的Bloom摘要：判定不存在时一定不存在
+// 摘要随RPC发给联系人后由双方共享，引用计数大于1时不再原地修改，存入新Key前先复制
+typedef struct BloomFilter {
+    int refs;
+    SummaryHandle handle;
+    uint32_t num_bits; //2的幂
+    uint64_t bits[];
+} BloomFilter;
+
+// 摘要表：句柄即下标，0号不用；摘要释放后句柄进入空闲栈复用
+// 摘要只在模拟主线程中创建，但并发基准的写者删除联系人时也可能释放摘要，因此加锁
+typedef struct SummaryTable {
+    BloomFilter **filters;
+    SummaryHandle *free_handles;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t num_free;
+    pthread_mutex_t lock;
+} SummaryTable;
+
+SummaryTable summary_table = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define SUMMARY(handle) ((handle) == NO_SUMMARY ? NULL : summary_table.filters[handle])
+
+// 每个桶是一个顺序锁：写者把seq加到奇数后修改，完成后再加到偶数；
+// 读者前后两次读到相同的偶数seq才算拿到一致的快照，否则重试
+typedef struct Bucket {
+    uint32_t seq;
     int size;
+    PeerHandle bucket[BUCKET_SIZE]; //下标0为最久未联系的节点
+    uint16_t rtt[BUCKET_SIZE]; //到对应联系人的RTT指数滑动平均，单位RTT_UNIT_US，0表示还没测过
+    SummaryHandle summary[BUCKET_SIZE]; //联系人最近一次RPC时发来的Key摘要，之后它再存入的Key不会反映在这里
 } Bucket;
 
 typedef struct PeerID {
-    uint8_t id[20]; 
+    uint8_t id[20];
 } PeerID;
 
 typedef struct KeyValuePair {
     PeerID key;
-    uint8_t value[32]; 
+    uint8_t value[32];
 } KeyValuePair;
 
+// 存储和桶都按需分配：大多数节点只会用到前log2(N)个左右的桶
+// 路由表（buckets）可被多个线程并发读写，存储部分仍只由模拟主线程访问
 typedef struct K_BUCKET {
-    PeerID peer_id;
-    KeyValuePair stored_values[BUCKETS];
-    Bucket buckets[BUCKETS];
+    PeerHandle self;
+    BloomFilter *bloom; //随联系人信息一起发给路由邻居，还没有存储时为NULL
+    KeyValuePair *stored_values; //按存入顺序追加，下标不会变化
+    uint32_t *key_index; //stored_values的下标，前num_sorted项与其余部分各自按Key字节序排列
+    Bucket *buckets[BUCKETS / BUCKET_CHUNK];
     int num_values;
+    int num_sorted; //新Key先插入较短的尾段，插入只移动尾段，尾段过长时再整体合并
+    int max_values;
+    int num_buckets; //已分配的桶组覆盖到的桶数，只增不减
 } K_BUCKET;
 
 typedef struct Peer {
-    PeerID peer_id;
-    K_BUCKET *k_bucket;
+    K_BUCKET k_bucket;
+    float x, y; //延迟模型中的坐标
+    _Bool alive; //离开网络后为false，之后发给它的RPC都会超时
 } Peer;
 
-uint32_t XORdistance(PeerID *a, PeerID *b) {
-    uint32_t distance = 0;
+// 全局的PeerID驻留表，ids与peers都按句柄连续存放
+typedef struct PeerTable {
+    PeerID *ids;     //按缓存行对齐，便于顺序扫描
+    Peer *peers;
+    uint32_t *slots; //开放寻址哈希表，保存句柄+1，0表示空位
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t slot_mask;
+} PeerTable;
+
+PeerTable peer_table;
+
+#define PEER(handle) (&peer_table.peers[handle])
+#define PEER_ID(handle) (&peer_table.ids[handle])
+
+// 模拟网络的消息统计
+typedef struct NetStats {
+    long messages; //发出的RPC总数（FIND_NODE/FIND_VALUE/STORE/PING/LEAVE）
+    long timeouts; //发往已离线节点的RPC数
+    long handoffs; //因新节点更近而转交、对方原来没有的Key数
+    long bloom_skips; //Bloom摘要判定不存在而省去的存储扫描数
+    long bloom_false_positives; //摘要判定可能存在但实际没有的次数
+    long summary_bytes; //随RPC和FIND_NODE回复发送的Key摘要字节数，对方已有同一版本时只发版本号，不计
+    long lookup_rpcs; //查找本身发出的RPC数，即跳数
+    long lookup_latency_us; //查找本身依次等待各RPC回复的模拟时间总和
+} NetStats;
+
+NetStats net_stats;
+#define COUNT(field) __atomic_fetch_add(&net_stats.field, 1, __ATOMIC_RELAXED)
+#define COUNT_N(field, n) __atomic_fetch_add(&net_stats.field, (n), __ATOMIC_RELAXED)
+long seqlock_retries; //读者因写者并发修改而重读桶的次数
+_Bool use_bloom = false; //开启后联系人随RPC交换Key摘要，GetValue先问摘要显示可能存有该Key的节点
+_Bool use_oracle = false; //开启后查找直接按oracle给出的真实最近节点询问，作为全局知识下的开销基线
+_Bool use_proximity = true; //桶满时优先保留低延迟联系人，查找时距离相当的候选先问快的
+
+// 按容量预分配驻留表，哈希表大小取不小于两倍容量的2的幂
+void InitPeerTable(uint32_t capacity) {
+    uint32_t num_slots = 1;
+    while (num_slots < capacity * 2) {
+        num_slots <<= 1;
+    }
+    size_t ids_size = (sizeof(PeerID) * capacity + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    peer_table.ids = (PeerID *)aligned_alloc(CACHE_LINE, ids_size);
+    peer_table.peers = (Peer *)calloc(capacity, sizeof(Peer));
+    peer_table.slots = (uint32_t *)calloc(num_slots, sizeof(uint32_t));
+    peer_table.count = 0;
+    peer_table.capacity = capacity;
+    peer_table.slot_mask = num_slots - 1;
+}
+
+// 返回PeerID对应的句柄，第一次出现时分配新句柄；表满时返回NO_PEER
+PeerHandle InternPeerID(PeerID *peer_id) {
+    uint32_t hash;
+    memcpy(&hash, peer_id->id, sizeof(hash)); //PeerID本身是随机的，直接取前4字节作哈希
+    uint32_t slot = hash & peer_table.slot_mask;
+    while (peer_table.slots[slot] != 0) {
+        PeerHandle handle = peer_table.slots[slot] - 1;
+        if (memcmp(peer_table.ids[handle].id, peer_id->id, 20) == 0) {
+            return handle;
+        }
+        slot = (slot + 1) & peer_table.slot_mask;
+    }
+    if (peer_table.count == peer_table.capacity) {
+        return NO_PEER;
+    }
+    PeerHandle handle = peer_table.count++;
+    peer_table.ids[handle] = *peer_id;
+    peer_table.slots[slot] = handle + 1;
+    peer_table.peers[handle].k_bucket.self = handle;
+    return handle;
+}
+
+// 分配一个num_bits位的空摘要并在摘要表中登记句柄
+BloomFilter *BloomAlloc(uint32_t num_bits) {
+    BloomFilter *bloom = (BloomFilter *)calloc(1, sizeof(BloomFilter) + num_bits / 8);
+    if (bloom == NULL) {
+        return NULL;
+    }
+    bloom->refs = 1;
+    bloom->num_bits = num_bits;
+    pthread_mutex_lock(&summary_table.lock);
+    if (summary_table.num_free > 0) {
+        bloom->handle = summary_table.free_handles[--summary_table.num_free];
+    } else {
+        if (summary_table.count == 0) {
+            summary_table.count = 1; //跳过NO_SUMMARY
+        }
+        if (summary_table.count >= summary_table.capacity) {
+            uint32_t capacity = summary_table.capacity ? summary_table.capacity * 2 : 1024;
+            BloomFilter **filters = (BloomFilter **)realloc(summary_table.filters, sizeof(BloomFilter *) * capacity);
+            SummaryHandle *free_handles = (SummaryHandle *)realloc(summary_table.free_handles, sizeof(SummaryHandle) * capacity);
+            if (filters != NULL) {
+                summary_table.filters = filters;
+            }
+            if (free_handles != NULL) {
+                summary_table.free_handles = free_handles;
+            }
+            if (filters == NULL || free_handles == NULL) {
+                pthread_mutex_unlock(&summary_table.lock);
+                free(bloom);
+                return NULL;
+            }
+            summary_table.capacity = capacity;
+        }
+        bloom->handle = summary_table.count++;
+    }
+    summary_table.filters[bloom->handle] = bloom;
+    pthread_mutex_unlock(&summary_table.lock);
+    return bloom;
+}
+
+// 按num_keys个Key分配摘要，位数取不小于num_keys*BLOOM_BITS_PER_KEY的2的幂
+BloomFilter *BloomCreate(int num_keys) {
+    uint32_t num_bits = BLOOM_MIN_BITS;
+    while (num_bits < (uint64_t)num_keys * BLOOM_BITS_PER_KEY) {
+        num_bits <<= 1;
+    }
+    return BloomAlloc(num_bits);
+}
+
+BloomFilter *BloomRetain(BloomFilter *bloom) {
+    if (bloom != NULL) {
+        __atomic_fetch_add(&bloom->refs, 1, __ATOMIC_RELAXED);
+    }
+    return bloom;
+}
+
+void BloomRelease(BloomFilter *bloom) {
+    if (bloom != NULL && __atomic_sub_fetch(&bloom->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&summary_table.lock);
+        summary_table.filters[bloom->handle] = NULL;
+        summary_table.free_handles[summary_table.num_free++] = bloom->handle;
+        pthread_mutex_unlock(&summary_table.lock);
+        free(bloom);
+    }
+}
+
+// 摘要的传输字节数
+size_t BloomBytes(BloomFilter *bloom) {
+    return bloom ? sizeof(bloom->num_bits) + bloom->num_bits / 8 : 0;
+}
+
+// 第i个哈希位置：Key本身是SHA-1摘要，取末尾8字节作两个32位值做双重哈希
+// 不用开头的字节：节点存储和收到的Key与节点ID有公共前缀，开头几个字节几乎不变
+uint32_t BloomBit(BloomFilter *bloom, uint8_t key[], int i) {
+    uint32_t h1, h2;
+    memcpy(&h1, key + 12, sizeof(h1));
+    memcpy(&h2, key + 16, sizeof(h2));
+    return (h1 + i * (h2 | 1)) & (bloom->num_bits - 1);
+}
+
+void BloomAdd(BloomFilter *bloom, uint8_t key[]) {
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = BloomBit(bloom, key, i);
+        bloom->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+// 摘要为NULL表示对方没有存储任何Key
+_Bool BloomMayContain(BloomFilter *bloom, uint8_t key[]) {
+    if (bloom == NULL) {
+        return false;
+    }
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = BloomBit(bloom, key, i);
+        if ((bloom->bits[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 本地延迟模型：节点随机分布在100x100的平面上，期望RTT = 5ms + 每单位距离2ms；
+// 节点之间交换坐标，所以也可以用它来估计还没联系过的节点的RTT
+uint32_t ModelRTT(PeerHandle a, PeerHandle b) {
+    float dx = PEER(a)->x - PEER(b)->x;
+    float dy = PEER(a)->y - PEER(b)->y;
+    return 5000 + (uint32_t)(2000 * sqrtf(dx * dx + dy * dy));
+}
+
+// 一次实际RPC的RTT：期望值上下10%的抖动
+uint32_t SampleRTT(PeerHandle a, PeerHandle b) {
+    uint32_t rtt = ModelRTT(a, b);
+    return rtt - rtt / 10 + (uint32_t)(rand() % (rtt / 5 + 1));
+}
+
+// 比较a、b到key的异或距离：a更近返回负数，相等返回0，b更近返回正数
+int XORCompare(PeerID *a, PeerID *b, PeerID *key) {
     for (int i = 0; i < 20; i++) {
-        distance += (a->id[i] ^ b->id[i]) << (8 * (19 - i));
+        uint8_t da = a->id[i] ^ key->id[i];
+        uint8_t db = b->id[i] ^ key->id[i];
+        if (da != db) {
+            return da < db ? -1 : 1;
+        }
     }
-    return distance;
+    return 0;
 }
 
+// 异或距离的前导零位数即桶下标，两个ID相同时返回BUCKETS
 int BucketIndex(PeerID *peer_id, PeerID *key) {
-    uint32_t dist = XORdistance(peer_id, key);
-    int i;
-    for (i = 0; i < BUCKETS - 1; i++) {
-        if (dist < (1 << (BUCKETS - i - 1))) {
-            break;
+    for (int i = 0; i < 20; i++) {
+        uint8_t x = peer_id->id[i] ^ key->id[i];
+        if (x != 0) {
+            int j = 0;
+            while ((x & (0x80 >> j)) == 0) {
+                j++;
+            }
+            return i * 8 + j;
         }
     }
-    return i;
+    return BUCKETS;
 }
 
 //随机生成String
@@ -70,49 +329,785 @@ void RandomString(uint8_t *str, size_t length) {
 }
 
 //根据节点到目标节点的距离对节点进行排序
-void Sort(Peer **peers, int size, PeerID *key) {
-    for (int i = 0; i < size - 1; i++) {
-        for (int j = i + 1; j < size; j++) {
-            uint32_t dist_i = XORdistance(&peers[i]->peer_id, key);
-            uint32_t dist_j = XORdistance(&peers[j]->peer_id, key);
-            if (dist_i > dist_j) {
-                Peer *tmp = peers[i];
-                peers[i] = peers[j];
-                peers[j] = tmp;
+void Sort(PeerHandle *peers, int size, PeerID *key) {
+    for (int i = 1; i < size; i++) {
+        PeerHandle tmp = peers[i];
+        int j = i - 1;
+        while (j >= 0 && XORCompare(PEER_ID(peers[j]), PEER_ID(tmp), key) > 0) {
+            peers[j + 1] = peers[j];
+            j--;
+        }
+        peers[j + 1] = tmp;
+    }
+}
+
+// 取第index个桶，所在的桶组未分配时返回NULL
+Bucket *BucketAt(K_BUCKET *k_bucket, int index) {
+    Bucket *chunk = __atomic_load_n(&k_bucket->buckets[index / BUCKET_CHUNK], __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[index % BUCKET_CHUNK] : NULL;
+}
+
+// 取第index个桶，不存在时分配所在的桶组；多个写者同时分配时只保留一个
+Bucket *GetBucket(K_BUCKET *k_bucket, int index) {
+    Bucket *bucket = BucketAt(k_bucket, index);
+    if (bucket != NULL) {
+        return bucket;
+    }
+    Bucket *chunk = (Bucket *)calloc(BUCKET_CHUNK, sizeof(Bucket));
+    Bucket *expected = NULL;
+    if (!__atomic_compare_exchange_n(&k_bucket->buckets[index / BUCKET_CHUNK], &expected, chunk,
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(chunk);
+        chunk = expected;
+    }
+    int num_buckets = __atomic_load_n(&k_bucket->num_buckets, __ATOMIC_RELAXED);
+    int covered = (index / BUCKET_CHUNK + 1) * BUCKET_CHUNK;
+    while (num_buckets < covered
+           && !__atomic_compare_exchange_n(&k_bucket->num_buckets, &num_buckets, covered,
+                                           true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return &chunk[index % BUCKET_CHUNK];
+}
+
+// 写者独占一个桶：把偶数seq改成奇数，同一个桶的写者之间互相等待
+// CAS只有acquire语义，之后的relaxed写可能先于奇数seq被读者看到，所以还要一个release屏障
+void BucketLock(Bucket *bucket) {
+    uint32_t seq = __atomic_load_n(&bucket->seq, __ATOMIC_RELAXED);
+    while ((seq & 1) || !__atomic_compare_exchange_n(&bucket->seq, &seq, seq + 1,
+                                                     true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        sched_yield();
+        seq = __atomic_load_n(&bucket->seq, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void BucketUnlock(Bucket *bucket) {
+    __atomic_store_n(&bucket->seq, __atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+// 写者持有锁时修改桶内容，用原子写避免与读者的数据竞争
+void BucketSet(Bucket *bucket, int i, PeerHandle handle, uint16_t rtt, SummaryHandle summary) {
+    __atomic_store_n(&bucket->bucket[i], handle, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->rtt[i], rtt, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->summary[i], summary, __ATOMIC_RELAXED);
+}
+
+void BucketResize(Bucket *bucket, int size) {
+    __atomic_store_n(&bucket->size, size, __ATOMIC_RELAXED);
+}
+
+// 删除第i个联系人，后面的依次前移；其摘要引用由调用者处理
+void BucketErase(Bucket *bucket, int i) {
+    for (; i + 1 < bucket->size; i++) {
+        BucketSet(bucket, i, bucket->bucket[i + 1], bucket->rtt[i + 1], bucket->summary[i + 1]);
+    }
+    BucketResize(bucket, bucket->size - 1);
+}
+
+// 读者：无锁读出桶的一致快照，返回联系人个数；rtts、summaries为NULL时不读
+// 摘要只能由模拟主线程读取：写者替换联系人时会释放它的摘要
+int BucketSnapshot(Bucket *bucket, PeerHandle contacts[BUCKET_SIZE], uint16_t rtts[BUCKET_SIZE],
+                   SummaryHandle summaries[BUCKET_SIZE]) {
+    while (1) {
+        uint32_t seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) == 0) {
+            int size = __atomic_load_n(&bucket->size, __ATOMIC_RELAXED);
+            for (int i = 0; i < size && i < BUCKET_SIZE; i++) {
+                contacts[i] = __atomic_load_n(&bucket->bucket[i], __ATOMIC_RELAXED);
+                if (rtts != NULL) {
+                    rtts[i] = __atomic_load_n(&bucket->rtt[i], __ATOMIC_RELAXED);
+                }
+                if (summaries != NULL) {
+                    summaries[i] = __atomic_load_n(&bucket->summary[i], __ATOMIC_RELAXED);
+                }
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) == seq) {
+                return size;
             }
         }
+        __atomic_fetch_add(&seqlock_retries, 1, __ATOMIC_RELAXED);
+        sched_yield(); //写者可能被抢占，让出CPU而不是空转
     }
 }
 
-void FindNode(K_BUCKET *k_bucket, uint8_t key[], Peer *closest_peers[]) {
-    // 初始化结果数组
-    for (int i = 0; i < 2; i++) {
-        closest_peers[i] = NULL;
+// 最深的非空桶下标，没有联系人时返回-1
+int DeepestBucket(K_BUCKET *k_bucket) {
+    for (int i = __atomic_load_n(&k_bucket->num_buckets, __ATOMIC_ACQUIRE) - 1; i >= 0; i--) {
+        Bucket *bucket = BucketAt(k_bucket, i);
+        if (bucket != NULL && __atomic_load_n(&bucket->size, __ATOMIC_RELAXED) > 0) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    // 查找包含最近节点的桶
-    int bucket_index = BucketIndex(&k_bucket->peer_id, (PeerID *)key);
-    Bucket *bucket = &k_bucket->buckets[bucket_index];
+// 比bucket_index更深的桶中的联系人数；达到K_VALUE时，bucket_index桶中的联系人都不可能是本节点最近的K_VALUE个邻居
+int ContactsBeyond(K_BUCKET *k_bucket, int bucket_index) {
+    int count = 0;
+    for (int i = __atomic_load_n(&k_bucket->num_buckets, __ATOMIC_ACQUIRE) - 1; i > bucket_index; i--) {
+        Bucket *bucket = BucketAt(k_bucket, i);
+        if (bucket != NULL) {
+            count += __atomic_load_n(&bucket->size, __ATOMIC_RELAXED);
+        }
+    }
+    return count;
+}
 
-    // 如果桶中节点数量小于k，将所有节点添加到结果数组
-    if (bucket->size <= 2) {
-        for (int i = 0; i < bucket->size; i++) {
-            closest_peers[i] = (Peer *)&bucket->bucket[i]->id;
+// 在路由表中找联系人，找到时通过rtt、summary（可为NULL）返回它的RTT估计和摘要副本的句柄
+_Bool FindContact(K_BUCKET *k_bucket, PeerHandle contact, uint16_t *rtt, SummaryHandle *summary) {
+    int bucket_index = BucketIndex(PEER_ID(k_bucket->self), PEER_ID(contact));
+    Bucket *bucket = (bucket_index < BUCKETS) ? BucketAt(k_bucket, bucket_index) : NULL;
+    if (bucket == NULL) {
+        return false;
+    }
+    PeerHandle contacts[BUCKET_SIZE];
+    uint16_t rtts[BUCKET_SIZE];
+    SummaryHandle summaries[BUCKET_SIZE];
+    int size = BucketSnapshot(bucket, contacts, rtts, summaries);
+    for (int i = 0; i < size; i++) {
+        if (contacts[i] == contact) {
+            if (rtt != NULL) {
+                *rtt = rtts[i];
+            }
+            if (summary != NULL) {
+                *summary = summaries[i];
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// 从路由表中删除联系人
+void RemoveContact(K_BUCKET *k_bucket, PeerHandle contact) {
+    int bucket_index = BucketIndex(PEER_ID(k_bucket->self), PEER_ID(contact));
+    if (bucket_index >= BUCKETS) {
+        return;
+    }
+    Bucket *bucket = BucketAt(k_bucket, bucket_index);
+    if (bucket == NULL) {
+        return;
+    }
+    BucketLock(bucket);
+    for (int i = 0; i < bucket->size; i++) {
+        if (bucket->bucket[i] == contact) {
+            BloomRelease(SUMMARY(bucket->summary[i]));
+            BucketErase(bucket, i);
+            break;
+        }
+    }
+    BucketUnlock(bucket);
+}
+
+// 把联系人加入路由表，已存在则移到桶尾（最近联系）；rtt_us为本次测得的RTT，0表示没有测量
+// summary为对方随消息发来的Key摘要，NULL表示没有新摘要，保留已有的副本
+// 桶满时PING最久未联系的节点，不在线才替换；开启use_proximity时，
+// 若新联系人明显比桶中最慢的联系人快，则替换最慢的，否则丢弃新节点；
+// 但可能是最近K_VALUE个邻居的桶不按延迟替换，而是让更近的新联系人替换最远的：
+// 查找时先问快的节点，这个桶常在真正最近的邻居回复之前就被较远的节点占满
+// 返回true表示这是一个新加入、需要向它转交Key的联系人；远处的桶按延迟换入的联系人不算，
+// 否则每次换入都会重做一次转交，被换出后又换回的联系人还会再收到同样的Key
+_Bool InsertContact(K_BUCKET *k_bucket, PeerHandle contact, uint32_t rtt_us, BloomFilter *summary) {
+    int bucket_index = BucketIndex(PEER_ID(k_bucket->self), PEER_ID(contact));
+    if (bucket_index >= BUCKETS || !PEER(contact)->alive) {
+        return false;
+    }
+    uint32_t sample = (rtt_us + RTT_UNIT_US - 1) / RTT_UNIT_US;
+    if (sample > UINT16_MAX) {
+        sample = UINT16_MAX;
+    }
+    Bucket *bucket = GetBucket(k_bucket, bucket_index);
+    _Bool inserted = false;
+    uint16_t rtt = (uint16_t)sample;
+    SummaryHandle old_summary = NO_SUMMARY;
+    BucketLock(bucket);
+    int i = 0;
+    while (i < bucket->size && bucket->bucket[i] != contact) {
+        i++;
+    }
+    if (i < bucket->size) {
+        // 与TCP的SRTT一样，新样本占1/8
+        uint16_t old_rtt = bucket->rtt[i];
+        if (old_rtt != 0) {
+            rtt = (sample == 0) ? old_rtt : (uint16_t)(old_rtt + ((int)sample - old_rtt) / 8);
+        }
+        old_summary = bucket->summary[i];
+        BucketErase(bucket, i);
+    } else if (bucket->size == BUCKET_SIZE) {
+        COUNT(messages);
+        if (!PEER(bucket->bucket[0])->alive) {
+            COUNT(timeouts);
+            BloomRelease(SUMMARY(bucket->summary[0]));
+            BucketErase(bucket, 0);
+            inserted = true;
+        } else if (use_proximity && ContactsBeyond(k_bucket, bucket_index) < K_VALUE) {
+            PeerID *self_id = PEER_ID(k_bucket->self);
+            int farthest = 0;
+            for (int j = 1; j < BUCKET_SIZE; j++) {
+                if (XORCompare(PEER_ID(bucket->bucket[j]), PEER_ID(bucket->bucket[farthest]), self_id) > 0) {
+                    farthest = j;
+                }
+            }
+            if (XORCompare(PEER_ID(contact), PEER_ID(bucket->bucket[farthest]), self_id) < 0) {
+                BloomRelease(SUMMARY(bucket->summary[farthest]));
+                BucketErase(bucket, farthest);
+                inserted = true;
+            }
+        } else if (use_proximity && sample != 0) {
+            int slowest = 0;
+            for (int j = 1; j < BUCKET_SIZE; j++) {
+                if (bucket->rtt[j] > bucket->rtt[slowest]) {
+                    slowest = j;
+                }
+            }
+            if (sample * PNS_MARGIN < (uint32_t)bucket->rtt[slowest] * (PNS_MARGIN - 1)) {
+                BloomRelease(SUMMARY(bucket->summary[slowest]));
+                BucketErase(bucket, slowest);
+            }
         }
     } else {
-        // 否则，对桶中的节点进行排序，选择距离最近的k个节点
-        Peer *sorted_peers[BUCKET_SIZE];
-        for (int i = 0; i < bucket->size; i++) {
-            sorted_peers[i] = (Peer *)&bucket->bucket[i];
+        inserted = true;
+    }
+    if (bucket->size < BUCKET_SIZE) {
+        if (summary != NULL && summary->handle != old_summary) {
+            COUNT_N(summary_bytes, BloomBytes(summary));
+            BloomRelease(SUMMARY(old_summary));
+            old_summary = BloomRetain(summary)->handle;
+        }
+        BucketSet(bucket, bucket->size, contact, rtt, old_summary);
+        BucketResize(bucket, bucket->size + 1);
+    }
+    BucketUnlock(bucket);
+    return inserted;
+}
+
+// 本节点到contact的RTT估计（微秒）：路由表中有测量值就用它，否则用坐标估计
+uint32_t ContactRTT(K_BUCKET *k_bucket, PeerHandle contact) {
+    uint16_t rtt;
+    if (FindContact(k_bucket, contact, &rtt, NULL) && rtt != 0) {
+        return rtt * RTT_UNIT_US;
+    }
+    return ModelRTT(k_bucket->self, contact);
+}
+
+// 本节点保存的contact的摘要副本，不在路由表中时返回NULL
+BloomFilter *ContactSummary(K_BUCKET *k_bucket, PeerHandle contact) {
+    SummaryHandle summary = NO_SUMMARY;
+    FindContact(k_bucket, contact, NULL, &summary);
+    return SUMMARY(summary);
+}
+
+// 在有序索引的[low, high)段中二分查找第一个不小于key（upper为true时大于key）的位置
+int KeySearch(K_BUCKET *k_bucket, int low, int high, uint8_t key[], _Bool upper) {
+    while (low < high) {
+        int mid = (low + high) / 2;
+        int cmp = memcmp(k_bucket->stored_values[k_bucket->key_index[mid]].key.id, key, 20);
+        if (cmp < 0 || (upper && cmp == 0)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// 在主段和尾段中查找Key，返回其在key_index中的位置，不存在时返回-1
+int KeyFind(K_BUCKET *k_bucket, uint8_t key[]) {
+    int pos = KeySearch(k_bucket, 0, k_bucket->num_sorted, key, false);
+    if (pos == k_bucket->num_sorted || memcmp(k_bucket->stored_values[k_bucket->key_index[pos]].key.id, key, 20) != 0) {
+        pos = KeySearch(k_bucket, k_bucket->num_sorted, k_bucket->num_values, key, false);
+    }
+    if (pos < k_bucket->num_values && memcmp(k_bucket->stored_values[k_bucket->key_index[pos]].key.id, key, 20) == 0) {
+        return pos;
+    }
+    return -1;
+}
+
+// 把尾段并入主段：从后往前，对尾段中每个Key二分查找它在主段中的位置，整块移动其后的主段元素，
+// 只比较O(尾段×log n)次，主段元素只顺序移动一次，不必逐个访问它们的Key
+void KeyMerge(K_BUCKET *k_bucket) {
+    int tail = k_bucket->num_values - k_bucket->num_sorted;
+    if (tail == 0) {
+        return;
+    }
+    uint32_t *buffer = (uint32_t *)malloc(sizeof(uint32_t) * tail);
+    memcpy(buffer, &k_bucket->key_index[k_bucket->num_sorted], sizeof(uint32_t) * tail);
+    int end = k_bucket->num_sorted;
+    for (int j = tail - 1; j >= 0; j--) {
+        int pos = KeySearch(k_bucket, 0, end, k_bucket->stored_values[buffer[j]].key.id, false);
+        memmove(&k_bucket->key_index[pos + j + 1], &k_bucket->key_index[pos], (end - pos) * sizeof(uint32_t));
+        k_bucket->key_index[pos + j] = buffer[j];
+        end = pos;
+    }
+    free(buffer);
+    k_bucket->num_sorted = k_bucket->num_values;
+}
+
+// 范围查询需要整体有序，先合并尾段
+int KeyRange(K_BUCKET *k_bucket, PeerID *prefix, int bits, int *first) {
+    KeyMerge(k_bucket);
+    PeerID low = *prefix, high = *prefix;
+    for (int i = bits; i < BUCKETS; i++) {
+        uint8_t bit = 0x80 >> (i % 8);
+        low.id[i / 8] &= (uint8_t)~bit;
+        high.id[i / 8] |= bit;
+    }
+    *first = KeySearch(k_bucket, 0, k_bucket->num_values, low.id, false);
+    return KeySearch(k_bucket, 0, k_bucket->num_values, high.id, true) - *first;
+}
+
+// 在本节点存储中查找Key，摘要判定不存在时跳过查找
+uint8_t *FindValue(K_BUCKET *k_bucket, uint8_t key[]) {
+    if (use_bloom && !BloomMayContain(k_bucket->bloom, key)) {
+        COUNT(bloom_skips);
+        return NULL;
+    }
+    int pos = KeyFind(k_bucket, key);
+    if (pos >= 0) {
+        return k_bucket->stored_values[k_bucket->key_index[pos]].value;
+    }
+    if (use_bloom) {
+        COUNT(bloom_false_positives);
+    }
+    return NULL;
+}
+
+// 把键值对存入本节点，已存在时不重复存储，存储空间不足时按两倍扩展
+// 新Key插入尾段，尾段长度保持在平方根级别，n个Key的插入总开销为O(n^1.5)而不是O(n^2)
+_Bool StoreLocal(K_BUCKET *k_bucket, uint8_t key[], uint8_t value[]) {
+    if (KeyFind(k_bucket, key) >= 0) {
+        return true;
+    }
+    if (k_bucket->num_values == k_bucket->max_values) {
+        int max_values = k_bucket->max_values ? k_bucket->max_values * 2 : 4;
+        KeyValuePair *stored_values = (KeyValuePair *)realloc(k_bucket->stored_values, sizeof(KeyValuePair) * max_values);
+        if (stored_values == NULL) {
+            return false;
+        }
+        k_bucket->stored_values = stored_values;
+        uint32_t *key_index = (uint32_t *)realloc(k_bucket->key_index, sizeof(uint32_t) * max_values);
+        if (key_index == NULL) {
+            return false;
+        }
+        k_bucket->key_index = key_index;
+        k_bucket->max_values = max_values;
+        // 存储容量翻倍时按新容量重建摘要，保持每个Key至少BLOOM_BITS_PER_KEY位
+        BloomFilter *bloom = BloomCreate(max_values);
+        if (bloom == NULL) {
+            return false;
+        }
+        for (int i = 0; i < k_bucket->num_values; i++) {
+            BloomAdd(bloom, k_bucket->stored_values[i].key.id);
+        }
+        BloomRelease(k_bucket->bloom);
+        k_bucket->bloom = bloom;
+    } else if (__atomic_load_n(&k_bucket->bloom->refs, __ATOMIC_RELAXED) > 1) {
+        // 摘要已发给联系人，联系人保留发送时的版本，本节点改用一份副本
+        BloomFilter *bloom = BloomAlloc(k_bucket->bloom->num_bits);
+        if (bloom == NULL) {
+            return false;
+        }
+        memcpy(bloom->bits, k_bucket->bloom->bits, bloom->num_bits / 8);
+        BloomRelease(k_bucket->bloom);
+        k_bucket->bloom = bloom;
+    }
+    memcpy(k_bucket->stored_values[k_bucket->num_values].key.id, key, 20);
+    memcpy(k_bucket->stored_values[k_bucket->num_values].value, value, 32);
+    int pos = KeySearch(k_bucket, k_bucket->num_sorted, k_bucket->num_values, key, false);
+    memmove(&k_bucket->key_index[pos + 1], &k_bucket->key_index[pos], (k_bucket->num_values - pos) * sizeof(uint32_t));
+    k_bucket->key_index[pos] = k_bucket->num_values;
+    k_bucket->num_values++;
+    int tail = k_bucket->num_values - k_bucket->num_sorted;
+    if (tail > KEY_TAIL_MIN && (long)tail * tail > k_bucket->num_values) {
+        KeyMerge(k_bucket);
+    }
+    BloomAdd(k_bucket->bloom, key);
+    return true;
+}
+
+_Bool SendRPC(PeerHandle from, PeerHandle to, uint32_t *elapsed_us);
+
+// 新联系人比本节点更接近某些Key时，把这些Key转交给它
+// 每次只处理一个新联系人，新节点加入时的转交因此是增量进行的
+// 联系人落在第b个桶时（前b位与本节点相同、第b位不同），Key的第b位与联系人相同就更接近联系人，
+// 与Key的前b位无关；按前b位把有序索引分段，每段中第b位与联系人相同的Key是一个连续范围
+void HandOffKeys(PeerHandle holder, PeerHandle contact) {
+    K_BUCKET *k_bucket = &PEER(holder)->k_bucket;
+    int bit = BucketIndex(PEER_ID(holder), PEER_ID(contact));
+    uint8_t mask = 0x80 >> (bit % 8);
+    uint8_t contact_bit = PEER_ID(contact)->id[bit / 8] & mask;
+    uint32_t *closer = NULL;
+    int count = 0, max_count = 0;
+    int pos = 0;
+    KeyMerge(k_bucket);
+    while (pos < k_bucket->num_values) {
+        PeerID prefix = k_bucket->stored_values[k_bucket->key_index[pos]].key;
+        int segment_first;
+        int segment_count = KeyRange(k_bucket, &prefix, bit, &segment_first);
+        prefix.id[bit / 8] = (prefix.id[bit / 8] & (uint8_t)~mask) | contact_bit;
+        int first;
+        int num = KeyRange(k_bucket, &prefix, bit + 1, &first);
+        if (num > 0) {
+            if (count + num > max_count) {
+                max_count = (count + num) * 2;
+                closer = (uint32_t *)realloc(closer, sizeof(uint32_t) * max_count);
+            }
+            memcpy(&closer[count], &k_bucket->key_index[first], sizeof(uint32_t) * num);
+            count += num;
         }
-        Sort(sorted_peers, bucket->size, (PeerID *)key);
-        for (int i = 0; i < 2; i++) {
-            closest_peers[i] = sorted_peers[i];
+        pos = segment_first + segment_count;
+    }
+    // 一次STORE携带全部这些Key；对方可能借这次RPC反过来向本节点转交Key，
+    // key_index会变化，stored_values下标则不变，因此先记下下标
+    if (count > 0 && SendRPC(holder, contact, NULL)) {
+        for (int i = 0; i < count; i++) {
+            KeyValuePair *pair = &k_bucket->stored_values[closer[i]];
+            // 只统计对方原来没有的Key
+            if (KeyFind(&PEER(contact)->k_bucket, pair->key.id) < 0
+                && StoreLocal(&PEER(contact)->k_bucket, pair->key.id, pair->value)) {
+                COUNT(handoffs);
+            }
         }
     }
+    free(closer);
 }
 
-_Bool SetValue(K_BUCKET *k_bucket, uint8_t key[], uint8_t value[]) {
+// 收到contact的消息后更新路由表，遇到新联系人时进行Key转交
+void Touch(PeerHandle self, PeerHandle contact, uint32_t rtt_us) {
+    BloomFilter *summary = use_bloom ? PEER(contact)->k_bucket.bloom : NULL;
+    if (InsertContact(&PEER(self)->k_bucket, contact, rtt_us, summary)) {
+        HandOffKeys(self, contact);
+    }
+}
+
+// 模拟一次RPC：对方在线时双方都会把对方、本次RTT和对方当前的摘要记入路由表，离线则超时并从路由表删除
+// elapsed_us不为NULL时返回发送方等待的时间
+_Bool SendRPC(PeerHandle from, PeerHandle to, uint32_t *elapsed_us) {
+    COUNT(messages);
+    if (!PEER(to)->alive) {
+        COUNT(timeouts);
+        RemoveContact(&PEER(from)->k_bucket, to);
+        if (elapsed_us != NULL) {
+            *elapsed_us = RPC_TIMEOUT_US;
+        }
+        return false;
+    }
+    uint32_t rtt = SampleRTT(from, to);
+    if (elapsed_us != NULL) {
+        *elapsed_us = rtt;
+    }
+    Touch(to, from, rtt);
+    Touch(from, to, rtt);
+    return true;
+}
+
+// 在本地路由表中查找距离key最近的k个节点，返回找到的个数，其余位置填NO_PEER
+int FindNode(K_BUCKET *k_bucket, uint8_t key[], PeerHandle closest_peers[], int k) {
+    // 初始化结果数组
+    for (int i = 0; i < k; i++) {
+        closest_peers[i] = NO_PEER;
+    }
+
+    // 收集所有桶中的节点（每个桶取一次无锁快照），按距离排序后取前k个
+    PeerHandle sorted_peers[BUCKETS * BUCKET_SIZE];
+    int count = 0;
+    int num_buckets = __atomic_load_n(&k_bucket->num_buckets, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < num_buckets; i++) {
+        Bucket *bucket = BucketAt(k_bucket, i);
+        if (bucket != NULL) {
+            count += BucketSnapshot(bucket, &sorted_peers[count], NULL, NULL);
+        }
+    }
+    Sort(sorted_peers, count, (PeerID *)key);
+    if (count > k) {
+        count = k;
+    }
+    for (int i = 0; i < count; i++) {
+        closest_peers[i] = sorted_peers[i];
+    }
+    return count;
+}
+
+// 精确k近邻（oracle）：直接扫描驻留表中全部PeerID，用于评估查找是否找到了真正最近的节点
+// 先比较异或距离的前8字节，只有不比当前第k名更远的ID才做完整比较
+
+typedef struct OracleTask {
+    PeerID *target;
+    uint32_t begin;
+    uint32_t end;
+    int k;
+    int count;
+    PeerHandle nearest[SHORTLIST_SIZE]; //按距离排好序
+} OracleTask;
+
+// ID前8字节按大端读成整数，两个ID前缀的异或即异或距离的高64位
+uint64_t IDPrefix(const uint8_t *id) {
+    uint64_t prefix;
+    memcpy(&prefix, id, sizeof(prefix));
+    return __builtin_bswap64(prefix);
+}
+
+// 当前第k名的距离前缀，不足k个时任何ID都可能入选
+uint64_t OracleThreshold(OracleTask *task) {
+    if (task->count < task->k) {
+        return UINT64_MAX;
+    }
+    return IDPrefix(PEER_ID(task->nearest[task->count - 1])->id) ^ IDPrefix(task->target->id);
+}
+
+// 把候选节点按距离插入结果，超过k个时丢弃最远的
+void OracleInsert(OracleTask *task, PeerHandle handle) {
+    if (!PEER(handle)->alive) {
+        return;
+    }
+    int pos = task->count;
+    while (pos > 0 && XORCompare(PEER_ID(task->nearest[pos - 1]), PEER_ID(handle), task->target) > 0) {
+        pos--;
+    }
+    if (pos >= task->k) {
+        return;
+    }
+    int tail = (task->count < task->k) ? task->count : task->k - 1;
+    memmove(&task->nearest[pos + 1], &task->nearest[pos], (tail - pos) * sizeof(PeerHandle));
+    task->nearest[pos] = handle;
+    if (task->count < task->k) {
+        task->count++;
+    }
+}
+
+void *OracleScan(void *arg) {
+    OracleTask *task = (OracleTask *)arg;
+    uint64_t target_prefix = IDPrefix(task->target->id);
+    uint64_t threshold = OracleThreshold(task);
+    uint32_t i = task->begin;
+#ifdef __AVX2__
+    // 每次处理4个ID：取前缀、字节反转成大端、异或，再与阈值做无符号比较（翻转符号位后用有符号比较）
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+    const __m256i target_vec = _mm256_set1_epi64x((long long)target_prefix);
+    for (; i + 4 <= task->end; i += 4) {
+        const uint8_t *id = peer_table.ids[i].id;
+        uint64_t raw[4];
+        memcpy(&raw[0], id, 8);
+        memcpy(&raw[1], id + 20, 8);
+        memcpy(&raw[2], id + 40, 8);
+        memcpy(&raw[3], id + 60, 8);
+        __m256i dist = _mm256_loadu_si256((const __m256i *)raw);
+        dist = _mm256_xor_si256(_mm256_shuffle_epi8(dist, reverse), target_vec);
+        __m256i limit = _mm256_set1_epi64x((long long)(threshold ^ 0x8000000000000000ULL));
+        __m256i farther = _mm256_cmpgt_epi64(_mm256_xor_si256(dist, sign), limit);
+        int candidates = ~_mm256_movemask_pd(_mm256_castsi256_pd(farther)) & 0xf;
+        while (candidates) {
+            int lane = __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+            OracleInsert(task, i + lane);
+            threshold = OracleThreshold(task);
+        }
+    }
+#endif
+    for (; i < task->end; i++) {
+        if ((IDPrefix(peer_table.ids[i].id) ^ target_prefix) <= threshold) {
+            OracleInsert(task, i);
+            threshold = OracleThreshold(task);
+        }
+    }
+    return NULL;
+}
+
+// 返回距离target最近的k个在线节点（k不超过SHORTLIST_SIZE），节点多时按CPU核数分段并行扫描再合并
+int OracleNearest(PeerID *target, PeerHandle result[], int k) {
+    if (k > SHORTLIST_SIZE) {
+        k = SHORTLIST_SIZE;
+    }
+    uint32_t count = peer_table.count;
+    int num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > ORACLE_THREADS) {
+        num_threads = ORACLE_THREADS;
+    }
+    if (num_threads < 1 || count < ORACLE_MIN_PER_THREAD * 2) {
+        num_threads = 1;
+    } else if (count / num_threads < ORACLE_MIN_PER_THREAD) {
+        num_threads = count / ORACLE_MIN_PER_THREAD;
+    }
+
+    OracleTask tasks[ORACLE_THREADS];
+    pthread_t threads[ORACLE_THREADS];
+    _Bool started[ORACLE_THREADS];
+    for (int t = 0; t < num_threads; t++) {
+        tasks[t].target = target;
+        tasks[t].begin = (uint32_t)((uint64_t)count * t / num_threads);
+        tasks[t].end = (uint32_t)((uint64_t)count * (t + 1) / num_threads);
+        tasks[t].k = k;
+        tasks[t].count = 0;
+    }
+    for (int t = 1; t < num_threads; t++) {
+        started[t] = (pthread_create(&threads[t], NULL, OracleScan, &tasks[t]) == 0);
+        if (!started[t]) {
+            OracleScan(&tasks[t]);
+        }
+    }
+    OracleScan(&tasks[0]);
+    for (int t = 1; t < num_threads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+        for (int i = 0; i < tasks[t].count; i++) {
+            OracleInsert(&tasks[0], tasks[t].nearest[i]);
+        }
+    }
+    for (int i = 0; i < tasks[0].count; i++) {
+        result[i] = tasks[0].nearest[i];
+    }
+    return tasks[0].count;
+}
+
+// 迭代查找：不断向候选列表中最近且未询问过的节点发送FIND_NODE，直到最近的k个都已询问
+// value不为NULL时按FIND_VALUE处理，某个节点存有该Key即提前返回；
+// 此时回复中的每个联系人附带回复者保存的摘要副本，副本显示可能存有该Key的候选不按距离顺序，直接先询问
+// 开启use_proximity时，与最近候选落在同一距离区间（异或距离最高位相同）的候选中先问RTT最小的
+int Lookup(PeerHandle origin, PeerID *target, PeerHandle result[], int k, uint8_t **value) {
+    PeerHandle shortlist[SHORTLIST_SIZE];
+    _Bool queried[SHORTLIST_SIZE];
+    _Bool likely[SHORTLIST_SIZE]; //候选加入时附带的摘要副本显示可能存有该Key
+    _Bool use_summaries = (value != NULL) && use_bloom;
+    if (use_oracle) {
+        int num_nearest = OracleNearest(target, shortlist, k + 1);
+        int count = 0;
+        for (int i = 0; i < num_nearest && count < k; i++) {
+            if (shortlist[i] == origin) {
+                continue;
+            }
+            uint32_t elapsed = 0;
+            _Bool replied = (value != NULL) && SendRPC(origin, shortlist[i], &elapsed);
+            if (value != NULL) {
+                COUNT(lookup_rpcs);
+                COUNT_N(lookup_latency_us, elapsed);
+            }
+            if (replied) {
+                *value = FindValue(&PEER(shortlist[i])->k_bucket, target->id);
+                if (*value != NULL) {
+                    break;
+                }
+            }
+            result[count++] = shortlist[i];
+        }
+        return count;
+    }
+    int count = FindNode(&PEER(origin)->k_bucket, target->id, shortlist, SHORTLIST_SIZE);
+    memset(queried, 0, sizeof(queried));
+    for (int i = 0; i < count; i++) {
+        likely[i] = use_summaries && BloomMayContain(ContactSummary(&PEER(origin)->k_bucket, shortlist[i]), target->id);
+    }
+
+    while (1) {
+        int next = -1;
+        for (int i = 0; i < count && use_summaries; i++) {
+            if (!queried[i] && likely[i]) {
+                next = i;
+                break;
+            }
+        }
+        if (next < 0) {
+            for (int i = 0; i < count && i < k; i++) {
+                if (!queried[i]) {
+                    next = i;
+                    break;
+                }
+            }
+            if (next >= 0 && use_proximity) {
+                K_BUCKET *origin_bucket = &PEER(origin)->k_bucket;
+                int distance_class = BucketIndex(PEER_ID(shortlist[next]), target);
+                uint32_t best_rtt = ContactRTT(origin_bucket, shortlist[next]);
+                for (int i = next + 1; i < count && i < k && BucketIndex(PEER_ID(shortlist[i]), target) == distance_class; i++) {
+                    if (!queried[i]) {
+                        uint32_t rtt = ContactRTT(origin_bucket, shortlist[i]);
+                        if (rtt < best_rtt) {
+                            best_rtt = rtt;
+                            next = i;
+                        }
+                    }
+                }
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+
+        PeerHandle peer = shortlist[next];
+        uint32_t elapsed;
+        _Bool replied = SendRPC(origin, peer, &elapsed);
+        COUNT(lookup_rpcs);
+        COUNT_N(lookup_latency_us, elapsed);
+        if (!replied) {
+            memmove(&shortlist[next], &shortlist[next + 1], (count - next - 1) * sizeof(PeerHandle));
+            memmove(&queried[next], &queried[next + 1], (count - next - 1) * sizeof(_Bool));
+            memmove(&likely[next], &likely[next + 1], (count - next - 1) * sizeof(_Bool));
+            count--;
+            continue;
+        }
+        queried[next] = true;
+
+        K_BUCKET *k_bucket = &PEER(peer)->k_bucket;
+        if (value != NULL) {
+            *value = FindValue(k_bucket, target->id);
+            if (*value != NULL) {
+                break;
+            }
+        }
+
+        PeerHandle reply[BUCKET_SIZE];
+        int num_reply = FindNode(k_bucket, target->id, reply, BUCKET_SIZE);
+        for (int i = 0; i < num_reply; i++) {
+            PeerHandle candidate = reply[i];
+            BloomFilter *summary = NULL;
+            if (use_summaries) {
+                summary = ContactSummary(k_bucket, candidate);
+                COUNT_N(summary_bytes, BloomBytes(summary));
+            }
+            _Bool known = (candidate == origin);
+            for (int j = 0; j < count && !known; j++) {
+                known = (shortlist[j] == candidate);
+            }
+            if (known) {
+                continue;
+            }
+            // 按距离插入候选列表，列表满时丢弃最远的
+            int pos = count;
+            while (pos > 0 && XORCompare(PEER_ID(shortlist[pos - 1]), PEER_ID(candidate), target) > 0) {
+                pos--;
+            }
+            if (pos >= SHORTLIST_SIZE) {
+                continue;
+            }
+            int tail = (count < SHORTLIST_SIZE) ? count : SHORTLIST_SIZE - 1;
+            memmove(&shortlist[pos + 1], &shortlist[pos], (tail - pos) * sizeof(PeerHandle));
+            memmove(&queried[pos + 1], &queried[pos], (tail - pos) * sizeof(_Bool));
+            memmove(&likely[pos + 1], &likely[pos], (tail - pos) * sizeof(_Bool));
+            shortlist[pos] = candidate;
+            queried[pos] = false;
+            likely[pos] = BloomMayContain(summary, target->id);
+            if (count < SHORTLIST_SIZE) {
+                count++;
+            }
+        }
+    }
+
+    if (count > k) {
+        count = k;
+    }
+    for (int i = 0; i < count; i++) {
+        result[i] = shortlist[i];
+    }
+    return count;
+}
+
+int LookupNode(PeerHandle origin, PeerID *target, PeerHandle result[], int k) {
+    return Lookup(origin, target, result, k, NULL);
+}
+
+_Bool SetValue(PeerHandle peer, uint8_t key[], uint8_t value[]) {
    uint8_t hash[SHA1_DIGEST_SIZE];
    SHA1_CTX ctx;
    sha1_init(&ctx);
@@ -121,58 +1116,289 @@ _Bool SetValue(K_BUCKET *k_bucket, uint8_t key[], uint8_t value[]) {
    if (memcmp(key, hash, 20) != 0) {
        return false;
    }
-    for (int i = 0; i < k_bucket->num_values; i++) {
-        if (memcmp(k_bucket->stored_values[i].key.id, key, 20) == 0) {
-            return true;
+    StoreLocal(&PEER(peer)->k_bucket, key, value);
+
+    PeerHandle closest_peers[K_VALUE];
+    int count = LookupNode(peer, (PeerID *)key, closest_peers, K_VALUE);
+
+    for (int i = 0; i < count; i++) {
+        if (SendRPC(peer, closest_peers[i], NULL)) {
+            StoreLocal(&PEER(closest_peers[i])->k_bucket, key, value);
         }
     }
+    return true;
+}
 
-    memcpy(k_bucket->stored_values[k_bucket->num_values].key.id, key, 20);
-    memcpy(k_bucket->stored_values[k_bucket->num_values].value, value, 32);
-    k_bucket->num_values++;
+uint8_t *GetValue(PeerHandle peer, uint8_t key[]) {
+    uint8_t *value = FindValue(&PEER(peer)->k_bucket, key);
+    if (value != NULL) {
+        return value;
+    }
+
+    PeerHandle closest_peers[K_VALUE];
+    Lookup(peer, (PeerID *)key, closest_peers, K_VALUE, &value);
+    if (value == NULL) {
+        return NULL;
+    }
 
-    int bucket_index = BucketIndex(&k_bucket->peer_id, (PeerID *)key);
-    Bucket *bucket = &k_bucket->buckets[bucket_index];
+    uint8_t hash[SHA1_DIGEST_SIZE];
+    SHA1_CTX ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, value, 32);
+    sha1_final(&ctx, hash);
+    if (memcmp(key, hash, 20) == 0) {
+        return value;
+    }
+    return NULL;
+}
+
+// 新节点加入：先把引导节点加入路由表，再对自己的ID做一次查找，
+// 最后刷新比最近邻居更远的每个桶（对桶范围内的随机ID做查找）
+void JoinNetwork(PeerHandle peer, PeerHandle bootstrap) {
+    PEER(peer)->alive = true;
+    if (bootstrap == NO_PEER) {
+        return;
+    }
+    K_BUCKET *k_bucket = &PEER(peer)->k_bucket;
+    InsertContact(k_bucket, bootstrap, 0, NULL);
 
-    Peer *closest_peers[2];
-    FindNode(k_bucket, key, closest_peers);
+    PeerHandle closest_peers[BUCKET_SIZE];
+    LookupNode(peer, PEER_ID(peer), closest_peers, BUCKET_SIZE);
 
-    for (int i = 0; i < 2; i++) {
-        if (closest_peers[i] != NULL) {
-            SetValue(closest_peers[i]->k_bucket, key, value);
+    int nearest = DeepestBucket(k_bucket);
+    for (int i = 0; i < nearest; i++) {
+        // 前i位与自己相同、第i位相反、其余随机的ID落在第i个桶的范围内
+        PeerID target = *PEER_ID(peer);
+        int byte = i / 8;
+        uint8_t bit = 0x80 >> (i % 8);
+        uint8_t low = bit - 1;
+        target.id[byte] = ((target.id[byte] ^ bit) & (uint8_t)~low) | (rand() & low);
+        for (int j = byte + 1; j < 20; j++) {
+            target.id[j] = rand() % 256;
         }
+        LookupNode(peer, &target, closest_peers, BUCKET_SIZE);
     }
-    return true;
 }
 
-uint8_t *GetValue(K_BUCKET *k_bucket, uint8_t key[]) {
-       for (int i = 0; i < k_bucket->num_values; i++) {
-        if (memcmp(k_bucket->stored_values[i].key.id, key, 20) == 0) {
-            return k_bucket->stored_values[i].value;
+// 检查新节点加入后是否已收敛：它的路由表中最近的K_VALUE个联系人正是真正最近的K_VALUE个在线节点，
+// 且这些节点的路由表中也已经有了它
+_Bool JoinConverged(PeerHandle peer) {
+    PeerHandle nearest[K_VALUE + 1], known[K_VALUE];
+    int num_nearest = OracleNearest(PEER_ID(peer), nearest, K_VALUE + 1);
+    int num_known = FindNode(&PEER(peer)->k_bucket, PEER_ID(peer)->id, known, K_VALUE);
+    int rank = 0;
+    for (int i = 0; i < num_nearest && rank < K_VALUE; i++) {
+        if (nearest[i] == peer) {
+            continue;
+        }
+        if (rank >= num_known || known[rank] != nearest[i] || !FindContact(&PEER(nearest[i])->k_bucket, peer, NULL, NULL)) {
+            return false;
         }
+        rank++;
     }
+    return true;
+}
 
-    Peer *closest_peers[2];
-    FindNode(k_bucket, key, closest_peers);
+// 节点离开：正常离开时先把存储的Key重新发布到其余最近节点并通知联系人，
+// 异常离开时直接下线，其他节点在RPC超时后才会把它从路由表中删除
+void LeaveNetwork(PeerHandle peer, _Bool graceful) {
+    K_BUCKET *k_bucket = &PEER(peer)->k_bucket;
+    if (graceful) {
+        for (int i = 0; i < k_bucket->num_values; i++) {
+            KeyValuePair pair = k_bucket->stored_values[i];
+            PeerHandle closest_peers[K_VALUE];
+            int count = LookupNode(peer, &pair.key, closest_peers, K_VALUE);
+            for (int j = 0; j < count; j++) {
+                if (SendRPC(peer, closest_peers[j], NULL)) {
+                    StoreLocal(&PEER(closest_peers[j])->k_bucket, pair.key.id, pair.value);
+                }
+            }
+        }
+        for (int i = 0; i < k_bucket->num_buckets; i++) {
+            Bucket *bucket = BucketAt(k_bucket, i);
+            if (bucket == NULL) {
+                continue;
+            }
+            // 每次只在持锁时取出一个联系人，通知对方时不持有本节点的桶锁
+            while (1) {
+                BucketLock(bucket);
+                PeerHandle contact = NO_PEER;
+                if (bucket->size > 0) {
+                    contact = bucket->bucket[bucket->size - 1];
+                    BloomRelease(SUMMARY(bucket->summary[bucket->size - 1]));
+                    BucketResize(bucket, bucket->size - 1);
+                }
+                BucketUnlock(bucket);
+                if (contact == NO_PEER) {
+                    break;
+                }
+                COUNT(messages);
+                if (PEER(contact)->alive) {
+                    RemoveContact(&PEER(contact)->k_bucket, peer);
+                }
+            }
+        }
+    }
+    PEER(peer)->alive = false;
+}
 
-    for (int i = 0; i < 2; i++) {
-        if (closest_peers[i] != NULL) {
-            uint8_t *value = GetValue(closest_peers[i]->k_bucket, key);
-            if (value != NULL) {
-                
-                uint8_t hash[SHA1_DIGEST_SIZE];
-                SHA1_CTX ctx;
-                sha1_init(&ctx);
-                sha1_update(&ctx, value, 32);
-                sha1_final(&ctx, hash);
-                if (memcmp(key, hash, 20) == 0) {
-                    return value;
-                } else {
-                    return NULL;
+// 重新发布本节点负责的Key，即按本节点的路由表，本节点是最近K_VALUE个节点之一的Key：
+// 与自己公共前缀恰为q位的Key，第q个桶中的联系人都比自己近，更深的桶中的联系人可能更近；
+// 若第p个及更深的桶中联系人不足K_VALUE个，公共前缀至少p位的Key都由本节点负责，直接按前缀范围取出；
+// 更短的前缀只在第q个桶不足K_VALUE个联系人时逐个Key数出更近的联系人
+// 路由表中可能还留着异常离开的节点，先从最深的桶往上PING，超时的会被删除，
+// 直到第i个及更深的桶中已有K_VALUE个在线联系人，p即为i+1
+int Republish(PeerHandle peer) {
+    K_BUCKET *k_bucket = &PEER(peer)->k_bucket;
+    int p = 0;
+    for (int i = DeepestBucket(k_bucket); i >= 0; i--) {
+        Bucket *bucket = BucketAt(k_bucket, i);
+        if (bucket == NULL) {
+            continue;
+        }
+        PeerHandle contacts[BUCKET_SIZE];
+        int size = BucketSnapshot(bucket, contacts, NULL, NULL);
+        for (int j = 0; j < size; j++) {
+            SendRPC(peer, contacts[j], NULL);
+        }
+        if (ContactsBeyond(k_bucket, i - 1) >= K_VALUE) {
+            p = i + 1;
+            break;
+        }
+    }
+    // 查找过程中其他节点可能向本节点转交Key，key_index会变化，stored_values下标则不变，因此先记下下标
+    int first;
+    int count = KeyRange(k_bucket, PEER_ID(peer), p, &first);
+    int max_count = count + 16;
+    uint32_t *owned = (uint32_t *)malloc(sizeof(uint32_t) * max_count);
+    memcpy(owned, &k_bucket->key_index[first], sizeof(uint32_t) * count);
+    PeerHandle deeper[BUCKETS * BUCKET_SIZE];
+    int num_deeper = 0;
+    int num_buckets = __atomic_load_n(&k_bucket->num_buckets, __ATOMIC_ACQUIRE);
+    for (int q = num_buckets - 1; q >= 0; q--) {
+        Bucket *bucket = BucketAt(k_bucket, q);
+        PeerHandle contacts[BUCKET_SIZE];
+        int size = (bucket != NULL) ? BucketSnapshot(bucket, contacts, NULL, NULL) : 0;
+        if (q < p && size < K_VALUE) {
+            PeerID prefix = *PEER_ID(peer);
+            prefix.id[q / 8] ^= 0x80 >> (q % 8);
+            int num = KeyRange(k_bucket, &prefix, q + 1, &first);
+            for (int i = first; i < first + num; i++) {
+                PeerID *key = &k_bucket->stored_values[k_bucket->key_index[i]].key;
+                int closer = size;
+                for (int j = 0; j < num_deeper && closer < K_VALUE; j++) {
+                    if (XORCompare(PEER_ID(deeper[j]), PEER_ID(peer), key) < 0) {
+                        closer++;
+                    }
+                }
+                if (closer < K_VALUE) {
+                    if (count == max_count) {
+                        max_count *= 2;
+                        owned = (uint32_t *)realloc(owned, sizeof(uint32_t) * max_count);
+                    }
+                    owned[count++] = k_bucket->key_index[i];
                 }
             }
         }
+        memcpy(&deeper[num_deeper], contacts, sizeof(PeerHandle) * size);
+        num_deeper += size;
+    }
+    for (int i = 0; i < count; i++) {
+        KeyValuePair pair = k_bucket->stored_values[owned[i]];
+        PeerHandle closest_peers[K_VALUE];
+        int num_closest = LookupNode(peer, &pair.key, closest_peers, K_VALUE);
+        for (int j = 0; j < num_closest; j++) {
+            if (SendRPC(peer, closest_peers[j], NULL)) {
+                StoreLocal(&PEER(closest_peers[j])->k_bucket, pair.key.id, pair.value);
+            }
+        }
     }
+    free(owned);
+    return count;
+}
+
+// 统计驻留表与所有节点路由表、存储占用的内存（字节）
+size_t MemoryUsage(void) {
+    size_t bytes = sizeof(PeerID) * peer_table.capacity + sizeof(Peer) * peer_table.capacity
+                 + sizeof(uint32_t) * (peer_table.slot_mask + 1)
+                 + (sizeof(BloomFilter *) + sizeof(SummaryHandle)) * summary_table.capacity;
+    for (uint32_t i = 0; i < peer_table.count; i++) {
+        K_BUCKET *k_bucket = &peer_table.peers[i].k_bucket;
+        for (int j = 0; j < BUCKETS / BUCKET_CHUNK; j++) {
+            if (k_bucket->buckets[j] != NULL) {
+                bytes += sizeof(Bucket) * BUCKET_CHUNK;
+            }
+        }
+        bytes += (sizeof(KeyValuePair) + sizeof(uint32_t)) * k_bucket->max_values;
+        if (k_bucket->bloom != NULL) {
+            bytes += sizeof(BloomFilter) + k_bucket->bloom->num_bits / 8;
+        }
+    }
+    return bytes;
+}
+
+// 路由表并发基准：读线程不断对热点节点做FindNode，写线程不断插入/删除随机联系人
+typedef struct BenchWorker {
+    pthread_t thread;
+    unsigned int seed;
+    long ops;
+} BenchWorker;
+
+_Bool bench_stop;
+
+void *BenchReader(void *arg) {
+    BenchWorker *worker = (BenchWorker *)arg;
+    while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED)) {
+        PeerHandle peer = rand_r(&worker->seed) % BENCH_HOT_PEERS;
+        PeerID key;
+        for (int j = 0; j < 20; j++) {
+            key.id[j] = rand_r(&worker->seed) % 256;
+        }
+        PeerHandle closest_peers[K_VALUE];
+        FindNode(&PEER(peer)->k_bucket, key.id, closest_peers, K_VALUE);
+        worker->ops++;
+    }
+    return NULL;
+}
+
+void *BenchWriter(void *arg) {
+    BenchWorker *worker = (BenchWorker *)arg;
+    while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED)) {
+        PeerHandle peer = rand_r(&worker->seed) % BENCH_HOT_PEERS;
+        PeerHandle contact = rand_r(&worker->seed) % peer_table.count;
+        if (rand_r(&worker->seed) % 2 == 0) {
+            InsertContact(&PEER(peer)->k_bucket, contact, 0, NULL);
+        } else {
+            RemoveContact(&PEER(peer)->k_bucket, contact);
+        }
+        worker->ops++;
+    }
+    return NULL;
+}
+
+void RoutingBenchmark(int readers, int writers, double seconds) {
+    BenchWorker *workers = (BenchWorker *)calloc(readers + writers, sizeof(BenchWorker));
+    long retries = __atomic_load_n(&seqlock_retries, __ATOMIC_RELAXED);
+    bench_stop = false;
+    for (int i = 0; i < readers + writers; i++) {
+        workers[i].seed = (unsigned int)rand();
+        pthread_create(&workers[i].thread, NULL, i < readers ? BenchReader : BenchWriter, &workers[i]);
+    }
+    usleep((useconds_t)(seconds * 1e6));
+    __atomic_store_n(&bench_stop, true, __ATOMIC_RELAXED);
+    long reads = 0, writes = 0;
+    for (int i = 0; i < readers + writers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (i < readers) {
+            reads += workers[i].ops;
+        } else {
+            writes += workers[i].ops;
+        }
+    }
+    printf("%d readers, %d writers: %.2f M FindNode/s, %.2f M updates/s, %ld seqlock retries\n",
+           readers, writers, reads / seconds / 1e6, writes / seconds / 1e6,
+           __atomic_load_n(&seqlock_retries, __ATOMIC_RELAXED) - retries);
+    free(workers);
 }
 
 
@@ -414,27 +1640,75 @@ uint8_t *GetValue(K_BUCKET *k_bucket, uint8_t key[]) {
 //     return 0;
 // }
 
-int main() {
+int CompareLong(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
     srand(time(NULL));
-    // 初始化100个Peer节点
-   Peer peers[PEERS];
-     for (int i = 0; i < PEERS; i++) {
+    // 初始化PEERS个Peer节点，PeerID统一驻留在全局表中，句柄即下标
+    InitPeerTable(PEERS);
+    while (peer_table.count < PEERS) {
         // 初始化PeerID
         PeerID peer_id;
         for (int j = 0; j < 20; j++) {
             peer_id.id[j] = rand() % 256;
         }
+        InternPeerID(&peer_id);
+    }
+    // 延迟模型中的坐标
+    for (PeerHandle peer = 0; peer < PEERS; peer++) {
+        PEER(peer)->x = (float)(rand() % 10000) / 100;
+        PEER(peer)->y = (float)(rand() % 10000) / 100;
+    }
+    // ./DHT2 noprox：建网时也不按延迟选择邻居，作为对照
+    if (argc > 1 && strcmp(argv[1], "noprox") == 0) {
+        use_proximity = false;
+    }
+    // ./DHT2 bloom：建网时就交换Key摘要，之后对比开启和关闭摘要时的GetValue
+    if (argc > 1 && strcmp(argv[1], "bloom") == 0) {
+        use_bloom = true;
+    }
 
-        // 初始化K_BUCKET
-        K_BUCKET *k_bucket = (K_BUCKET *)malloc(sizeof(K_BUCKET));
-        k_bucket->peer_id = peer_id;
-        k_bucket->num_values = 0;
-        for (int j = 0; j < BUCKETS; j++) {
-            k_bucket->buckets[j].size = 0;
+    // 逐个加入网络，每个新节点从已在网络中的随机节点引导，统计每次加入的消息数，
+    // 以及加入过程中依次等待的RPC轮数和模拟时间；按oracle抽查加入完成时路由表是否已收敛
+    JoinNetwork(0, NO_PEER);
+    long join_messages = 0, join_rounds = 0, join_latency_us = 0;
+    int checked = 0, converged = 0;
+    int report_step = (PEERS >= 10) ? PEERS / 10 : 1;
+    int check_step = (PEERS >= 1000) ? PEERS / 1000 : 1; //oracle每次扫描全部节点，最多抽查约1000次加入
+    for (int i = 1; i < PEERS; i++) {
+        long messages = net_stats.messages;
+        long rounds = net_stats.lookup_rpcs;
+        long latency = net_stats.lookup_latency_us;
+        JoinNetwork(i, rand() % i);
+        join_messages += net_stats.messages - messages;
+        join_rounds += net_stats.lookup_rpcs - rounds;
+        join_latency_us += net_stats.lookup_latency_us - latency;
+        if (i % check_step == 0) {
+            checked++;
+            converged += JoinConverged(i);
         }
+        if ((i + 1) % report_step == 0 || i == PEERS - 1) {
+            printf("Joined %d peers: %.1f messages/join, %.1f RPC rounds/join, %.1f ms/join simulated, %d/%d joins converged\n",
+                   i + 1, (double)join_messages / i, (double)join_rounds / i, join_latency_us / 1000.0 / i,
+                   converged, checked);
+        }
+    }
+    printf("Memory: %.1f MB (%.0f bytes/peer)\n\n", MemoryUsage() / 1048576.0, (double)MemoryUsage() / PEERS);
 
-        peers[i].peer_id = peer_id;
-        peers[i].k_bucket = k_bucket;
+    // ./DHT2 bench [读线程数] [写线程数]：建好网络后只运行路由表并发基准，不指定读线程数时依次测1到8个
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        int writers = (argc > 3) ? atoi(argv[3]) : 1;
+        if (argc > 2) {
+            RoutingBenchmark(atoi(argv[2]), writers, 1.0);
+        } else {
+            for (int readers = 1; readers <= 8; readers *= 2) {
+                RoutingBenchmark(readers, writers, 1.0);
+            }
+        }
+        return 0;
     }
 
     uint8_t keys[200][20];
@@ -451,19 +1725,19 @@ int main() {
         memcpy(keys[i], key, 20);
 
         int random_peer_index = rand() % PEERS;
-        SetValue(peers[random_peer_index].k_bucket, key, random_string);
+        SetValue(random_peer_index, key, random_string);
     }
 
-   
+
     uint8_t selected_keys[100][20];
     for (int i = 0; i < 100; i++) {
         int random_key_index = rand() % 200;
         memcpy(selected_keys[i], keys[random_key_index], 20);
 
         int random_peer_index = rand() % PEERS;
-        uint8_t *value = GetValue(peers[random_peer_index].k_bucket, selected_keys[i]);
+        uint8_t *value = GetValue(random_peer_index, selected_keys[i]);
+
 
-        
         printf("Key %d: ", i);
         for (int j = 0; j < 20; j++) {
             printf("%02x", selected_keys[i][j]);
@@ -479,5 +1753,193 @@ int main() {
         printf("\n\n");
     }
 
+    // 在同一张路由表上比较按延迟和只按距离选择下一跳：固定的发起节点交替用两种方式查找，
+    // 每次查找都用新的随机目标，避免重复查询时路由表已缓存目标附近的节点而少走几跳；
+    // 跳数相同时的平均延迟才反映选路本身，跳数不同则主要是路由表和目标的差异
+    // （用FIND_NODE而不是GetValue，避免副本多少影响提前返回；noprox建网时只测只按距离的一组）
+    _Bool build_proximity = use_proximity;
+    int rounds = build_proximity ? 2 : 1;
+    long *latencies[2], *hop_latency[2], *hop_lookups[2];
+    long total_rpcs[2] = {0, 0}, total_latency[2] = {0, 0};
+    for (int round = 0; round < rounds; round++) {
+        latencies[round] = (long *)malloc(sizeof(long) * PROXIMITY_LOOKUPS);
+        hop_latency[round] = (long *)calloc(PROXIMITY_MAX_HOPS + 1, sizeof(long));
+        hop_lookups[round] = (long *)calloc(PROXIMITY_MAX_HOPS + 1, sizeof(long));
+    }
+    PeerHandle lookup_result[K_VALUE];
+    for (int i = 0; i < PROXIMITY_LOOKUPS; i++) {
+        PeerHandle origin = rand() % PEERS;
+        while (!PEER(origin)->alive) {
+            origin = rand() % PEERS;
+        }
+        for (int round = 0; round < rounds; round++) {
+            use_proximity = (round == 0) && build_proximity;
+            PeerID target;
+            for (int j = 0; j < 20; j++) {
+                target.id[j] = rand() % 256;
+            }
+            long rpcs = net_stats.lookup_rpcs, latency = net_stats.lookup_latency_us;
+            LookupNode(origin, &target, lookup_result, K_VALUE);
+            rpcs = net_stats.lookup_rpcs - rpcs;
+            latency = net_stats.lookup_latency_us - latency;
+            latencies[round][i] = latency;
+            total_rpcs[round] += rpcs;
+            total_latency[round] += latency;
+            int hops = (rpcs < PROXIMITY_MAX_HOPS) ? (int)rpcs : PROXIMITY_MAX_HOPS;
+            hop_latency[round][hops] += latency;
+            hop_lookups[round][hops]++;
+        }
+    }
+    use_proximity = build_proximity;
+    for (int round = 0; round < rounds; round++) {
+        qsort(latencies[round], PROXIMITY_LOOKUPS, sizeof(long), CompareLong);
+        printf("Proximity %s: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, %.2f hops/lookup, %.1f ms/hop\n",
+               (round == 0 && build_proximity) ? "on " : "off", latencies[round][PROXIMITY_LOOKUPS / 2] / 1000.0,
+               latencies[round][PROXIMITY_LOOKUPS * 9 / 10] / 1000.0, latencies[round][PROXIMITY_LOOKUPS * 99 / 100] / 1000.0,
+               (double)total_rpcs[round] / PROXIMITY_LOOKUPS,
+               total_latency[round] / 1000.0 / (total_rpcs[round] ? total_rpcs[round] : 1));
+        // 只列出占查找数5%以上的跳数
+        printf("  by hops:");
+        for (int hops = 1; hops <= PROXIMITY_MAX_HOPS; hops++) {
+            if (hop_lookups[round][hops] * 20 >= PROXIMITY_LOOKUPS) {
+                printf(" %d%s hops %.1f ms (%ld)", hops, (hops == PROXIMITY_MAX_HOPS) ? "+" : "",
+                       hop_latency[round][hops] / 1000.0 / hop_lookups[round][hops], hop_lookups[round][hops]);
+            }
+        }
+        printf("\n");
+        free(latencies[round]);
+        free(hop_latency[round]);
+        free(hop_lookups[round]);
+    }
+
+    // 随机选十分之一的节点离开网络（一半正常离开，一半异常离开），再从仍在线的节点查询所有Key
+    for (int i = 0; i < PEERS / 10; i++) {
+        PeerHandle peer = rand() % PEERS;
+        while (!PEER(peer)->alive) {
+            peer = rand() % PEERS;
+        }
+        LeaveNetwork(peer, i % 2 == 0);
+    }
+    // 在线节点重新发布自己负责的Key，补回异常离开丢失的副本
+    long republished = 0;
+    long republish_messages = net_stats.messages;
+    for (PeerHandle peer = 0; peer < PEERS; peer++) {
+        if (PEER(peer)->alive) {
+            republished += Republish(peer);
+        }
+    }
+    printf("Republished %ld owned keys, %.1f messages/peer\n",
+           republished, (double)(net_stats.messages - republish_messages) / (PEERS - PEERS / 10));
+    int found = 0;
+    long messages = net_stats.messages;
+    for (int i = 0; i < 200; i++) {
+        PeerHandle peer = rand() % PEERS;
+        while (!PEER(peer)->alive) {
+            peer = rand() % PEERS;
+        }
+        if (GetValue(peer, keys[i]) != NULL) {
+            found++;
+        }
+    }
+    printf("After %d peers left: %d/200 keys found, %.1f messages/get, %ld timeouts, %ld keys handed off\n",
+           PEERS / 10, found, (double)(net_stats.messages - messages) / 200, net_stats.timeouts, net_stats.handoffs);
+
+    // 分别在开启和关闭Bloom摘要时，统计命中与未命中的GetValue的消息数、耗时和摘要传输量
+    // （联系人只在建网时开启摘要才会有摘要副本，默认运行只测关闭摘要的一组）
+    uint8_t missing_keys[200][20];
+    for (int i = 0; i < 200; i++) {
+        uint8_t random_string[33];
+        RandomString(random_string, 32);
+        SHA1_CTX ctx;
+        sha1_init(&ctx);
+        sha1_update(&ctx, random_string, 32);
+        sha1_final(&ctx, missing_keys[i]);
+    }
+    _Bool build_bloom = use_bloom;
+    for (int round = build_bloom ? 0 : 1; round < 2; round++) {
+        use_bloom = (round == 0);
+        net_stats.bloom_false_positives = 0;
+        long summary_bytes = net_stats.summary_bytes;
+        long hit_messages = 0, miss_messages = 0;
+        double hit_seconds = 0, miss_seconds = 0;
+        int hits = 0, misses = 0;
+        for (int i = 0; i < 400; i++) {
+            PeerHandle peer = rand() % PEERS;
+            while (!PEER(peer)->alive) {
+                peer = rand() % PEERS;
+            }
+            uint8_t *key = (i % 2 == 0) ? keys[i / 2] : missing_keys[i / 2];
+            long messages = net_stats.messages;
+            clock_t start = clock();
+            uint8_t *value = GetValue(peer, key);
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            if (value != NULL) {
+                hits++;
+                hit_messages += net_stats.messages - messages;
+                hit_seconds += seconds;
+            } else {
+                misses++;
+                miss_messages += net_stats.messages - messages;
+                miss_seconds += seconds;
+            }
+        }
+        printf("Bloom %s: %d hits %.1f messages/get %.1f us/get, %d misses %.1f messages/get %.1f us/get, %ld false positives, %.0f summary bytes/get\n",
+               use_bloom ? "on " : "off", hits, (double)hit_messages / (hits ? hits : 1), hit_seconds * 1e6 / (hits ? hits : 1),
+               misses, (double)miss_messages / (misses ? misses : 1), miss_seconds * 1e6 / (misses ? misses : 1),
+               net_stats.bloom_false_positives, (net_stats.summary_bytes - summary_bytes) / 400.0);
+    }
+    use_bloom = build_bloom;
+
+    // 用oracle检查查找精度：LookupNode返回的K_VALUE个节点中有多少是真正最近的
+    int exact = 0;
+    long routed_messages = 0;
+    double lookup_seconds = 0, oracle_seconds = 0;
+    for (int i = 0; i < 200; i++) {
+        PeerHandle peer = rand() % PEERS;
+        while (!PEER(peer)->alive) {
+            peer = rand() % PEERS;
+        }
+        PeerHandle found_peers[K_VALUE], nearest[K_VALUE + 1];
+        long messages = net_stats.messages;
+        clock_t start = clock();
+        int num_found = LookupNode(peer, (PeerID *)keys[i], found_peers, K_VALUE);
+        lookup_seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+        routed_messages += net_stats.messages - messages;
+        start = clock();
+        int num_nearest = OracleNearest((PeerID *)keys[i], nearest, K_VALUE + 1);
+        oracle_seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+        int rank = 0;
+        for (int j = 0; j < num_nearest && rank < K_VALUE; j++) {
+            if (nearest[j] == peer) {
+                continue;
+            }
+            for (int m = 0; m < num_found; m++) {
+                if (found_peers[m] == nearest[j]) {
+                    exact++;
+                    break;
+                }
+            }
+            rank++;
+        }
+    }
+    printf("Lookup accuracy: %.1f%% of true %d-closest found, %.1f messages/lookup, %.1f us/lookup, oracle %.1f us/query\n",
+           exact * 100.0 / (200 * K_VALUE), K_VALUE, routed_messages / 200.0, lookup_seconds * 1e6 / 200, oracle_seconds * 1e6 / 200);
+
+    // 全局知识基线：GetValue直接询问真实最近的节点
+    use_oracle = true;
+    long oracle_messages = net_stats.messages;
+    found = 0;
+    for (int i = 0; i < 200; i++) {
+        PeerHandle peer = rand() % PEERS;
+        while (!PEER(peer)->alive) {
+            peer = rand() % PEERS;
+        }
+        if (GetValue(peer, keys[i]) != NULL) {
+            found++;
+        }
+    }
+    use_oracle = false;
+    printf("Oracle baseline: %d/200 keys found, %.1f messages/get\n", found, (net_stats.messages - oracle_messages) / 200.0);
+
     return 0;
 }
\ No newline at end of file